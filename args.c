@@ -21,6 +21,7 @@
 #include<float.h>
 #include<limits.h>
 #include<stdbool.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
@@ -30,6 +31,7 @@
 #include "pandaseq-sam.h"
 #ifdef HAVE_PTHREAD
 #        include<pthread.h>
+#        include "pandaseq-sam-mux.h"
 #endif
 
 struct panda_args_sam {
@@ -38,7 +40,25 @@ struct panda_args_sam {
 	const char *orphans_file;
 	char tag[PANDA_TAG_LEN];
 	bool no_algn_qual;
+	const char *no_algn_file;
 	PandaWriter no_algn_writer;
+	const char *output_file;
+	bool output_plain;
+	PandaWriter output_writer;
+	int compress_threads;
+	size_t max_uncalled;
+	double min_quality;
+	double max_errors;
+	bool ordered;
+	bool adaptive;
+	bool trace;
+	bool umi;
+	char umi_tag[3];
+	size_t umi_max_families;
+	size_t shard_index;
+	size_t shard_count;
+	PandaNextSeq next;
+	void *next_data;
 };
 
 PandaArgsSam panda_args_sam_new(
@@ -49,13 +69,35 @@ PandaArgsSam panda_args_sam_new(
 	data->orphans_file = NULL;
 	data->tag[0] = '\0';
 	data->no_algn_qual = false;
+	data->no_algn_file = NULL;
 	data->no_algn_writer = NULL;
+	data->output_file = NULL;
+	data->output_plain = false;
+	data->output_writer = NULL;
+	data->compress_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	data->max_uncalled = SIZE_MAX;
+	data->min_quality = 0;
+	data->max_errors = DBL_MAX;
+	data->ordered = false;
+	data->adaptive = false;
+	data->trace = false;
+	data->umi = false;
+	data->umi_tag[0] = '\0';
+	data->umi_max_families = 1024;
+	data->shard_index = 0;
+	data->shard_count = 1;
+	data->next = NULL;
+	data->next_data = NULL;
 	return data;
 }
 
 void panda_args_sam_free(
 	PandaArgsSam data) {
 	panda_writer_unref(data->no_algn_writer);
+	panda_writer_unref(data->output_writer);
+	if (data->trace) {
+		panda_sam_trace_close();
+	}
 	free(data);
 }
 
@@ -63,6 +105,7 @@ bool panda_args_sam_tweak(
 	PandaArgsSam data,
 	char flag,
 	const char *argument) {
+	char *end;
 	switch (flag) {
 	case 'b':
 		data->binary = true;
@@ -74,20 +117,94 @@ bool panda_args_sam_tweak(
 			return false;
 		}
 		return true;
+	case 'I':
+		data->ordered = true;
+		return true;
+	case 'J':
+		if (data->trace) {
+			panda_sam_trace_close();
+		}
+		data->trace = panda_sam_trace_open(argument);
+		return data->trace;
+	case 'm':
+		if (strcmp(argument, "qname") == 0) {
+			data->umi_tag[0] = '\0';
+		} else if (strlen(argument) == 2) {
+			memcpy(data->umi_tag, argument, 3);
+		} else {
+			fprintf(stderr, "UMI source %s must be a two-letter tag or \"qname\".\n", argument);
+			return false;
+		}
+		data->umi = true;
+		return true;
+	case 'M':
+		errno = 0;
+		data->umi_max_families = strtoul(argument, &end, 10);
+		if (errno != 0 || *end != '\0' || data->umi_max_families < 1 || strchr(argument, '-') != NULL) {
+			fprintf(stderr, "Bad maximum number of UMI families: %s\n", argument);
+			return false;
+		}
+		return true;
+	case 'n':
+		errno = 0;
+		/* strtoul happily negates a leading minus, which would wrap around to no limit at all. */
+		data->max_uncalled = strtoul(argument, &end, 10);
+		if (errno != 0 || *end != '\0' || strchr(argument, '-') != NULL) {
+			fprintf(stderr, "Bad maximum number of uncalled bases: %s\n", argument);
+			return false;
+		}
+		return true;
+	case 'P':
+		data->adaptive = true;
+		return true;
+	case 'Q':
+		errno = 0;
+		data->min_quality = strtod(argument, &end);
+		if (errno != 0 || *end != '\0' || data->min_quality < 0) {
+			fprintf(stderr, "Bad minimum mean quality: %s\n", argument);
+			return false;
+		}
+		return true;
 	case 'r':
 		data->orphans_file = argument;
 		return true;
 	case 'f':
-		data->filename = (strcmp(optarg, "-") == 0) ? "/dev/stdin" : argument;
+		data->filename = argument;
+		return true;
+	case 'S':
+		errno = 0;
+		data->shard_index = strtoul(argument, &end, 10);
+		if (errno == 0 && *end == '/') {
+			data->shard_count = strtoul(end + 1, &end, 10);
+		}
+		if (errno != 0 || *end != '\0' || data->shard_index < 1 || data->shard_index > data->shard_count || strchr(argument, '-') != NULL) {
+			fprintf(stderr, "Bad shard %s. It must be i/N where i is between 1 and N.\n", argument);
+			return false;
+		}
+		/* Shards are numbered from one on the command line, but zero in the library. */
+		data->shard_index--;
 		return true;
 	case 'u':
 	case 'U':
 		data->no_algn_qual = flag == 'U';
-		panda_writer_unref(data->no_algn_writer);
-		data->no_algn_writer = panda_writer_open_file(argument, false);
-		if (data->no_algn_writer == NULL)
-			perror(argument);
-		return (data->no_algn_writer != NULL);
+		data->no_algn_file = argument;
+		return true;
+	case 'Z':
+		errno = 0;
+		data->compress_threads = (int) strtol(argument, &end, 10);
+		if (errno != 0 || *end != '\0' || data->compress_threads < 1) {
+			fprintf(stderr, "Bad number of compression threads: %s\n", argument);
+			return false;
+		}
+		return true;
+	case 'x':
+		errno = 0;
+		data->max_errors = strtod(argument, &end);
+		if (errno != 0 || *end != '\0' || data->max_errors < 0) {
+			fprintf(stderr, "Bad maximum expected errors: %s\n", argument);
+			return false;
+		}
+		return true;
 	default:
 		return false;
 	}
@@ -95,6 +212,107 @@ bool panda_args_sam_tweak(
 
 #define MAYBE(x) if (x != NULL) *x
 
+static bool is_compressed_name(
+	const char *filename) {
+	size_t length = strlen(filename);
+	return length > 3 && strcmp(filename + length - 3, ".gz") == 0;
+}
+
+static bool takes_argument(
+	char flag) {
+	size_t it;
+	for (it = 0; it < panda_stdargs_length; it++) {
+		if (panda_stdargs[it]->flag == flag) {
+			return panda_stdargs[it]->takes_argument != NULL;
+		}
+	}
+	for (it = 0; it < panda_args_sam_args_length; it++) {
+		if (panda_args_sam_args[it]->flag == flag) {
+			return panda_args_sam_args[it]->takes_argument != NULL;
+		}
+	}
+	return false;
+}
+
+static void remove_args(
+	int *argc,
+	char **argv,
+	int index,
+	int count) {
+	/* Move the terminating null too. */
+	memmove(&argv[index], &argv[index + count], (*argc - index - count + 1) * sizeof(char *));
+	*argc -= count;
+}
+
+bool panda_args_sam_take_output(
+	PandaArgsSam data,
+	int *argc,
+	char **argv) {
+	int it = 1;
+	while (it < *argc && strcmp(argv[it], "--") != 0) {
+		char *flag;
+		int consumed = 1;
+		if (argv[it][0] != '-' || argv[it][1] == '\0') {
+			it++;
+			continue;
+		}
+		/* Walk the flags the way getopt does, since -w could be bundled with others or be another option's argument. */
+		for (flag = argv[it] + 1; *flag != '\0'; flag++) {
+			const char *value;
+			if (!takes_argument(*flag)) {
+				continue;
+			}
+			if (flag[1] != '\0') {
+				value = flag + 1;
+			} else {
+				value = it + 1 < *argc ? argv[it + 1] : NULL;
+				consumed = 2;
+			}
+			if (*flag == 'w' && value != NULL) {
+				if (!is_compressed_name(value)) {
+					data->output_plain = true;
+				} else if (flag == argv[it] + 1) {
+					data->output_file = value;
+					remove_args(argc, argv, it, consumed);
+					consumed = 0;
+				} else {
+					data->output_file = value;
+					*flag = '\0';
+					if (consumed == 2) {
+						remove_args(argc, argv, it + 1, 1);
+						consumed = 1;
+					}
+				}
+			}
+			break;
+		}
+		it += consumed;
+	}
+	if (data->output_file != NULL && data->output_plain) {
+		fprintf(stderr, "Only one output file may be given.\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Open a writer, compressing with BGZF if the file name ends in .gz.
+ */
+static PandaWriter open_writer(
+	PandaArgsSam data,
+	const char *filename) {
+	PandaWriter writer;
+	if (is_compressed_name(filename)) {
+		writer = panda_sam_writer_open_bgzf(filename, data->compress_threads);
+	} else {
+		writer = panda_writer_open_file(filename, false);
+	}
+	if (writer == NULL) {
+		perror(filename);
+	}
+	return writer;
+}
+
 PandaNextSeq panda_args_sam_opener(
 	PandaArgsSam data,
 	PandaLogProxy logger,
@@ -103,8 +321,28 @@ PandaNextSeq panda_args_sam_opener(
 	PandaDestroy *fail_destroy,
 	void **next_data,
 	PandaDestroy *next_destroy) {
+	PandaWriter reject_writer = NULL;
+	PandaNextSeq next;
+
+	if (data->no_algn_file != NULL) {
+		panda_writer_unref(data->no_algn_writer);
+		data->no_algn_writer = open_writer(data, data->no_algn_file);
+	}
+	if (data->output_file != NULL) {
+		panda_writer_unref(data->output_writer);
+		data->output_writer = open_writer(data, data->output_file);
+	}
+	if ((data->no_algn_file != NULL && data->no_algn_writer == NULL) || (data->output_file != NULL && data->output_writer == NULL)) {
+		*fail = NULL;
+		*fail_data = NULL;
+		*fail_destroy = NULL;
+		MAYBE(next_data) = NULL;
+		MAYBE(next_destroy) = NULL;
+		return NULL;
+	}
 
 	if (data->no_algn_writer != NULL) {
+		reject_writer = panda_writer_ref(data->no_algn_writer);
 		*fail = (PandaFailAlign) (data->no_algn_qual ? panda_output_fail_qual : panda_output_fail);
 		*fail_data = data->no_algn_writer;
 		*fail_destroy = (PandaDestroy) panda_writer_unref;
@@ -118,9 +356,29 @@ PandaNextSeq panda_args_sam_opener(
 	if (data->filename == NULL) {
 		MAYBE(next_data) = NULL;
 		MAYBE(next_destroy) = NULL;
+		panda_writer_unref(reject_writer);
 		return false;
 	}
-	return panda_create_sam_reader_ex(data->filename, logger, data->binary, data->tag, data->orphans_file, next_data, next_destroy);
+	if (strcmp(data->filename, "-") == 0) {
+		next = panda_create_sam_reader_fd(STDIN_FILENO, logger, data->binary, data->tag, data->orphans_file, next_data, next_destroy);
+	} else {
+		next = panda_create_sam_reader_ex(data->filename, logger, data->binary, data->tag, data->orphans_file, next_data, next_destroy);
+	}
+	if (next != NULL && (data->max_uncalled != SIZE_MAX || data->min_quality > 0 || data->max_errors < DBL_MAX)) {
+		/* Rejected pairs go with the unalignable ones, if they are being kept. */
+		panda_sam_reader_set_prefilter(*next_data, data->max_uncalled, data->min_quality, data->max_errors, reject_writer == NULL ? NULL : (PandaFailAlign) (data->no_algn_qual ? panda_output_fail_qual : panda_output_fail), reject_writer, (PandaDestroy) panda_writer_unref);
+		reject_writer = NULL;
+	}
+	panda_writer_unref(reject_writer);
+	if (next != NULL && data->shard_count > 1) {
+		panda_sam_reader_set_shard(*next_data, data->shard_index, data->shard_count);
+	}
+	if (next != NULL && data->umi) {
+		panda_sam_reader_set_umi(*next_data, data->umi_tag[0] == '\0' ? NULL : data->umi_tag, data->umi_max_families);
+	}
+	data->next = next;
+	data->next_data = next == NULL ? NULL : *next_data;
+	return next;
 }
 
 bool panda_args_sam_setup(
@@ -132,25 +390,102 @@ bool panda_args_sam_setup(
 	return true;
 }
 
+bool panda_args_sam_run(
+	PandaArgsSam data,
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy) {
+	if (data->output_writer != NULL) {
+		/*
+		 * The -w option was taken away from PANDAseq, so its output goes to
+		 * standard output and nothing has been written yet. The FASTA and FASTQ
+		 * callbacks write to any PandaWriter, so the compressed file can be
+		 * given to them instead.
+		 */
+		if (output != (PandaOutputSeq) panda_output_fasta && output != (PandaOutputSeq) panda_output_fastq) {
+			fprintf(stderr, "%s: compressed output is only possible for FASTA or FASTQ.\n", data->output_file);
+			if (output_destroy != NULL) {
+				output_destroy(output_data);
+			}
+			panda_assembler_unref(assembler);
+#ifdef HAVE_PTHREAD
+			if (mux != NULL) {
+				panda_mux_unref(mux);
+			}
+#endif
+			return false;
+		}
+		if (output_destroy != NULL) {
+			output_destroy(output_data);
+		}
+		output_data = data->output_writer;
+		output_destroy = (PandaDestroy) panda_writer_unref;
+		data->output_writer = NULL;
+	}
+	if (data->adaptive && threads > 1 && data->next != NULL) {
+		return panda_sam_run_pool_adaptive(threads, assembler, mux, data->next, data->next_data, data->ordered, output, output_data, output_destroy);
+	}
+	if (data->ordered && threads > 1 && data->next != NULL) {
+		return panda_sam_run_pool_ordered(threads, assembler, mux, data->next, data->next_data, output, output_data, output_destroy);
+	}
+	if (data->trace && data->next != NULL) {
+		return panda_sam_run_pool(threads, assembler, mux, data->next, data->next_data, output, output_data, output_destroy);
+	}
+	return panda_run_pool(threads, assembler, mux, output, output_data, output_destroy);
+}
+
 const panda_tweak_general args_filename = { 'f', false, "file.sam", "Input SAM/BAM file containing forward reads.", false };
 
 const panda_tweak_general args_bin = { 'b', true, NULL, "Read a binary (BAM) file rather than a text (SAM) file.", false };
 
-static const panda_tweak_general args_unalign_qual = { 'U', true, "unaligned.txt", "File to write unalignable read pairs with quality scores.", false };
+static const panda_tweak_general args_ordered = { 'I', true, NULL, "Write the assembled sequences in the same order as the input, even when using multiple threads.", false };
+
+static const panda_tweak_general args_adaptive = { 'P', true, NULL, "Share the threads between decompressing the input and assembling, moving them to whichever makes assembly faster.", false };
+
+static const panda_tweak_general args_shard = { 'S', true, "i/N", "Only assemble the pairs in shard i of N, chosen by a hash of the read name. Running all N shards covers every pair exactly once.", false };
+
+static const panda_tweak_general args_trace = { 'J', true, "trace.json", "Write a timeline of the reading and assembly of each thread in Chrome trace event format. This uses a traceable thread pool in place of PANDAseq's.", false };
+
+static const panda_tweak_general args_umi = { 'm', true, "RX", "Collapse read pairs with the same UMI, taken from this auxiliary tag or, if \"qname\", from after the last underscore in the read name, into a consensus pair.", false };
+
+static const panda_tweak_general args_umi_families = { 'M', true, "1024", "The maximum number of UMI families to collect at once.", false };
+
+static const panda_tweak_general args_compress_threads = { 'Z', true, "threads", "The number of threads shared by all BGZF-compressed output files (-w, -u or -U ending in .gz). The default is the number of processors.", false };
+
+static const panda_tweak_general args_unalign_qual = { 'U', true, "unaligned.txt", "File to write unalignable read pairs with quality scores. If the name ends in .gz, it will be BGZF-compressed.", false };
 
 const panda_tweak_general args_code = { 'B', true, "code", "Replace the Illumina multiplexing barcode stripped during processing into SAM/BAM.", false };
 
 const panda_tweak_general args_orphans = { 'r', true, "orphans.fastq", "Write all reads from the SAM/BAM that could not be paired or were discarded to a FASTQ file.", false };
 
-static const panda_tweak_general args_unalign = { 'u', true, "unaligned.txt", "File to write unalignable read pairs.", false };
+static const panda_tweak_general args_unalign = { 'u', true, "unaligned.txt", "File to write unalignable read pairs. If the name ends in .gz, it will be BGZF-compressed.", false };
+
+static const panda_tweak_general args_max_uncalled = { 'n', true, "count", "Discard read pairs with more than this many uncalled bases before assembly.", false };
+
+static const panda_tweak_general args_min_quality = { 'Q', true, "quality", "Discard read pairs with a mean quality score below this before assembly.", false };
+
+static const panda_tweak_general args_max_errors = { 'x', true, "errors", "Discard read pairs with more than this many expected errors before assembly.", false };
 
 const panda_tweak_general *const panda_args_sam_args[] = {
 	&args_code,
 	&args_bin,
 	&args_unalign_qual,
 	&args_filename,
+	&args_ordered,
+	&args_adaptive,
+	&args_trace,
+	&args_umi,
+	&args_umi_families,
+	&args_max_uncalled,
+	&args_min_quality,
 	&args_orphans,
-	&args_unalign
+	&args_shard,
+	&args_unalign,
+	&args_max_errors,
+	&args_compress_threads
 };
 
 const size_t panda_args_sam_args_length = sizeof(panda_args_sam_args) / sizeof(panda_tweak_general *);
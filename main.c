@@ -36,11 +36,11 @@ int main(
 	bool result;
 	int threads;
 
-	if (!panda_parse_args(argv, argc, panda_stdargs, panda_stdargs_length, panda_args_sam_args, panda_args_sam_args_length, (PandaTweakGeneral) panda_args_sam_tweak, (PandaOpener) panda_args_sam_opener, (PandaSetup) panda_args_sam_setup, data, &assembler, &mux, &threads, &output, &output_data, &output_destroy)) {
+	if (!panda_args_sam_take_output(data, &argc, argv) || !panda_parse_args(argv, argc, panda_stdargs, panda_stdargs_length, panda_args_sam_args, panda_args_sam_args_length, (PandaTweakGeneral) panda_args_sam_tweak, (PandaOpener) panda_args_sam_opener, (PandaSetup) panda_args_sam_setup, data, &assembler, &mux, &threads, &output, &output_data, &output_destroy)) {
 		panda_args_sam_free(data);
 		return 1;
 	}
-	result = panda_run_pool(threads, assembler, mux, output, output_data, output_destroy);
+	result = panda_args_sam_run(data, threads, assembler, mux, output, output_data, output_destroy);
 	panda_args_sam_free(data);
 	return result ? 0 : 1;
 }
@@ -86,6 +86,215 @@ PandaNextSeq panda_create_sam_reader_ex(
 	const char *orphan_file,
 	void **user_data,
 	PandaDestroy *destroy);
+/**
+ * Create an object to read sequences from an open SAM/BAM file descriptor.
+ *
+ * The reader takes ownership of the file descriptor and closes it when destroyed.
+ *
+ * @fd: the file descriptor, which need not be seekable
+ * @see panda_create_sam_reader_ex
+ */
+PandaNextSeq panda_create_sam_reader_fd(
+	int fd,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy);
+/**
+ * Create an object to read sequences from SAM/BAM data in memory.
+ *
+ * The data must not be changed or freed until the reader is destroyed. It is read in place if htslib exports hfile_init_fixed; otherwise, it is copied into htslib's read buffer a block at a time as it is read.
+ *
+ * @buffer:(array length=length): the complete contents of a SAM/BAM file
+ * @length: the number of bytes in the buffer
+ * @see panda_create_sam_reader_ex
+ */
+PandaNextSeq panda_create_sam_reader_buffer(
+	const void *buffer,
+	size_t length,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy);
+/**
+ * Create an object to read sequences from SAM/BAM data provided by a callback.
+ *
+ * The callback is called whenever more data is needed and should indicate the end of the data by reading zero bytes.
+ *
+ * @read:(closure read_data) (scope notified): the source of the SAM/BAM data
+ * @read_data: the context for the callback
+ * @read_destroy: the cleanup for the callback; it is called even if the reader cannot be created
+ * @see panda_create_sam_reader_ex
+ */
+PandaNextSeq panda_create_sam_reader_stream(
+	PandaBufferRead read,
+	void *read_data,
+	PandaDestroy read_destroy,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy);
+/**
+ * Discard read pairs that cannot assemble before they reach the assembler.
+ *
+ * The checks are done directly on the SAM/BAM record, so a rejected pair costs neither an assembly attempt nor a conversion. Rejected pairs are counted by reason and reported as a statistic when the reader is destroyed.
+ *
+ * @user_data: the reader data provided by panda_create_sam_reader_ex
+ * @max_uncalled: the maximum number of uncalled bases (N) allowed in the pair, or SIZE_MAX for no limit
+ * @min_quality: the minimum mean PHRED quality score of the pair, or 0 for no limit
+ * @max_errors: the maximum number of expected errors in the pair, or DBL_MAX for no limit
+ * @reject:(allow-none): where to send rejected pairs. The assembler provided will be null and the reason is appended to the tag of the identifier as `;prefilter=uncalled`, `;prefilter=quality` or `;prefilter=errors`. If null, the reads are written to the orphan file, if any, with the reason on the header line.
+ * @reject_data:(closure reject): the context for the rejection callback
+ * @reject_destroy: the cleanup for the rejection callback
+ */
+void panda_sam_reader_set_prefilter(
+	void *user_data,
+	size_t max_uncalled,
+	double min_quality,
+	double max_errors,
+	PandaFailAlign reject,
+	void *reject_data,
+	PandaDestroy reject_destroy);
+/**
+ * Collapse read pairs sharing a unique molecular identifier (UMI) into a single consensus pair.
+ *
+ * Pairs are collected into families by UMI. Each base of the consensus is chosen by a vote weighted by quality score; a family of one pair is returned as it was read. The number of pairs in the family is appended to the tag of the identifier as `;size=N`; a long tag is shortened to make room for it. Pairs without a UMI are passed through unchanged.
+ *
+ * Only a limited number of families are kept open; when a new family would exceed this, the oldest family is closed and returned. Input sorted or grouped by UMI will produce one consensus per UMI.
+ *
+ * @user_data: the reader data provided by panda_create_sam_reader_ex
+ * @tag:(allow-none): the two-letter auxiliary tag containing the UMI (e.g., RX), or null if the UMI follows the last underscore in the read name
+ * @max_families: the maximum number of families to keep open
+ * Returns: false if the tag is not valid
+ */
+bool panda_sam_reader_set_umi(
+	void *user_data,
+	const char *tag,
+	size_t max_families);
+/**
+ * Only process a slice of the input.
+ *
+ * Each read is assigned to one of the shards by a hash of its name (or the UMI in its name, if collapsing by UMI from the read name) as soon as it is read and reads in other shards are skipped entirely, including from the orphan file. Running every shard of the same file processes each pair exactly once.
+ *
+ * @user_data: the reader data provided by panda_create_sam_reader_ex
+ * @index: the shard to keep, starting from zero
+ * @count: the total number of shards
+ * Returns: false if the index is not less than the count
+ */
+bool panda_sam_reader_set_shard(
+	void *user_data,
+	size_t index,
+	size_t count);
+/**
+ * Use threads to decompress the input.
+ *
+ * @user_data: the reader data provided by panda_create_sam_reader_ex
+ * @threads: the number of decompression threads
+ */
+bool panda_sam_reader_set_threads(
+	void *user_data,
+	int threads);
+/**
+ * Get the position in the input of the pair most recently returned by the reader.
+ *
+ * Pairs are numbered from zero in the order they are returned; reads that were discarded do not consume a number.
+ *
+ * @user_data: the reader data provided by panda_create_sam_reader_ex
+ */
+size_t panda_sam_reader_ordinal(
+	void *user_data);
+/**
+ * Assemble all the sequences from a SAM reader using multiple threads.
+ *
+ * This behaves like panda_run_pool, but the stages are visible to tracing.
+ *
+ * @see panda_sam_run_pool_ordered
+ * @see panda_sam_trace_open
+ */
+bool panda_sam_run_pool(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy);
+/**
+ * Assemble all the sequences from a SAM reader using multiple threads, writing the results in input order.
+ *
+ * This is similar to panda_run_pool, but the results are put back in the order the pairs were read, so the output is the same regardless of the number of threads. Each thread holds a small number of assemblers so that it can keep working while earlier pairs are still being assembled elsewhere; the number of results waiting to be written is never more than this.
+ *
+ * @threads: the number of threads to use
+ * @assembler:(transfer full): the assembler created with the reader
+ * @mux:(transfer full) (allow-none): the multiplexer created with the reader; if null, only one thread is used
+ * @next: the sequence source callback from panda_create_sam_reader_ex
+ * @next_data: the reader data for the sequence source; it must still be owned by the assembler or multiplexer
+ * @output: the callback for each assembled sequence
+ * @output_data:(closure output): the context for the output callback
+ * @output_destroy: the cleanup for the output callback
+ */
+bool panda_sam_run_pool_ordered(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy);
+/**
+ * Assemble all the sequences from a SAM reader, balancing threads between decompression and assembly.
+ *
+ * Decompression and assembly share one pool of the number of threads requested. Each assembling thread runs as a long job on the pool, so the threads not assembling are free to decompress. The number of assembling threads starts at half and is adjusted as assembly progresses: one is added or removed, and the change is kept only if more pairs are assembled per second, otherwise it is undone. At least one thread is always left for decompression. The reader takes over the pool, so it must not already be using threads. If the pool cannot be set up, the pairs are assembled without balancing.
+ *
+ * @ordered: whether to write the results in input order, as panda_sam_run_pool_ordered
+ * @see panda_sam_run_pool
+ */
+bool panda_sam_run_pool_adaptive(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	bool ordered,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy);
+/**
+ * Start recording a timeline of the reading and assembly stages.
+ *
+ * Each thread records the start and duration of every stage into its own buffer; only the most recent events of each thread are kept. The stages are: read, which decompresses and decodes one SAM/BAM record; pair, which matches a read with its mate; parse, which parses the read name; fill, which converts the pair for the assembler; assemble; and write. Time spent waiting for the reader or writer is recorded as reader lock, writer lock and writer wait. The assemble, write and waiting stages are only visible when using panda_sam_run_pool, panda_sam_run_pool_ordered or panda_sam_run_pool_adaptive, since panda_run_pool does not expose them.
+ *
+ * @filename: the file where the trace will be written, in Chrome trace event format
+ * Returns: false if the file could not be opened or tracing is already on
+ */
+bool panda_sam_trace_open(
+	const char *filename);
+/**
+ * Stop recording and write the trace collected since panda_sam_trace_open.
+ *
+ * This must only be called once all assembly has finished.
+ */
+bool panda_sam_trace_close(
+	void);
+/**
+ * Open a file for writing with BGZF compression.
+ *
+ * BGZF files are readable by any gzip decompressor, but, since the file is made of independent blocks, the blocks can be compressed in parallel. All open BGZF writers share one pool of compression threads, so opening more files does not add threads. If the file cannot be finished when the writer is destroyed, the error is reported on standard error.
+ *
+ * @filename: the file to write
+ * @threads: the number of compression threads; if a pool is already shared by another open writer, it is used as is
+ */
+PandaWriter panda_sam_writer_open_bgzf(
+	const char *filename,
+	int threads);
 /**
  * Create a new assembler for given a SAM file.
  * @see panda_create_sam_reader
@@ -126,6 +335,22 @@ bool panda_args_sam_tweak(
 	char flag,
 	const char *argument);
 
+/**
+ * Take a compressed output file from the command line.
+ *
+ * PANDAseq opens the output file given by -w itself and cannot compress it. If the file name ends in .gz, the -w option is removed from the arguments and the file is written using BGZF instead. This must be called before panda_parse_args.
+ *
+ * This API is not guaranteed to be stable. It exists for the pandaseq-sam program and will be removed if PANDAseq allows the output writer to be replaced.
+ *
+ * @argc:(inout): the number of arguments, which may be reduced
+ * @argv:(array length=argc): the arguments, which may be rearranged or truncated
+ * Returns: false if both a compressed and an uncompressed output file were given
+ */
+bool panda_args_sam_take_output(
+	PandaArgsSam data,
+	int *argc,
+	char **argv);
+
 /**
  * Initialise the sequence stream for the SAM argument handler.
  */
@@ -145,5 +370,19 @@ bool panda_args_sam_setup(
 	PandaArgsSam data,
 	PandaAssembler assembler);
 
+/**
+ * Assemble all the sequences using the thread pool requested by the SAM argument handler.
+ *
+ * This takes the same arguments as panda_run_pool and must be called after the arguments have been parsed. If a compressed output file was taken by panda_args_sam_take_output, it is written instead of the output data, so the output callback must be panda_output_fasta or panda_output_fastq.
+ */
+bool panda_args_sam_run(
+	PandaArgsSam data,
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy);
+
 EXTERN_C_END
 #endif
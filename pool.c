@@ -0,0 +1,540 @@
+/* PANDAseq -- Assemble paired SAM/BAM Illumina reads and strip the region between amplification primers.
+     Copyright (C) 2012  Andre Masella
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "pandaseq-sam.h"
+#include "reader.h"
+#include "trace.h"
+#include <htslib/thread_pool.h>
+#ifdef HAVE_PTHREAD
+#        include <pthread.h>
+#        include "pandaseq-sam-mux.h"
+#endif
+
+/*
+ * The number of assemblers each thread juggles. A thread only has to wait for
+ * its turn to write when all of its assemblers are holding results.
+ */
+#define POOL_DEPTH 2
+/*
+ * When balancing threads, the rate of assembly is measured over this many
+ * pairs. Then one assembling thread is added or removed, in the direction
+ * that last helped, and the change is kept only if the rate improves by at
+ * least the gain. Otherwise, it is undone and nothing is tried for the hold,
+ * in intervals, after which the other direction is tried.
+ */
+#define ADAPT_INTERVAL 4096
+#define ADAPT_GAIN 0.02
+#define ADAPT_HOLD 8
+
+struct pool_slot {
+	PandaAssembler assembler;
+	panda_qual forward[PANDA_MAX_LEN];
+	panda_qual reverse[PANDA_MAX_LEN];
+	const panda_result_seq *result;
+	bool busy;
+	bool ready;
+};
+
+struct pool_data {
+	PandaNextSeq next;
+	void *next_data;
+	PandaOutputSeq output;
+	void *output_data;
+	bool ordered;
+	bool ok;
+	bool done;
+	/*
+	 * When balancing, the workers run as jobs on the thread pool the reader
+	 * decompresses with, so a worker that is not running leaves its thread to
+	 * decompression. These are protected by the reader lock.
+	 */
+	bool adaptive;
+	size_t active;
+	size_t workers_length;
+	struct pool_worker *workers;
+	hts_tpool *threads;
+	hts_tpool_process *jobs;
+	size_t running;
+	size_t adapt_pairs;
+	uint64_t adapt_start;
+	bool probing;
+	bool grow;
+	size_t hold;
+	double settled_rate;
+	size_t settled_active;
+#ifdef HAVE_PTHREAD
+	pthread_cond_t finished_cond;
+	pthread_mutex_t next_mutex;
+	pthread_mutex_t output_mutex;
+	pthread_cond_t released_cond;
+#endif
+	/* The ring of results waiting to be written, indexed by ordinal. */
+	struct pool_slot **pending;
+	size_t pending_length;
+	size_t released;
+};
+
+struct pool_worker {
+	struct pool_data *pool;
+	size_t index;
+	bool running;
+	struct pool_slot slots[POOL_DEPTH];
+	size_t slots_length;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+};
+
+static void *pool_run(
+	struct pool_worker *worker);
+
+#ifdef HAVE_PTHREAD
+/*
+ * Start jobs for the workers that are now allowed to assemble. Workers beyond
+ * the limit stop on their own the next time they read. The caller must hold
+ * the reader lock.
+ */
+static void pool_set_active(
+	struct pool_data *pool,
+	size_t active) {
+	size_t it;
+	pool->active = active;
+	for (it = 0; it < active; it++) {
+		struct pool_worker *worker = &pool->workers[it];
+		if (worker->running) {
+			continue;
+		}
+		if (hts_tpool_dispatch(pool->threads, pool->jobs, (void *(*)(void *)) pool_run, worker) != 0) {
+			pool->active = it;
+			break;
+		}
+		worker->running = true;
+		pool->running++;
+	}
+}
+
+/*
+ * Try moving a thread between assembly and decompression and keep the change
+ * if more pairs are assembled per second. The caller must hold the reader lock.
+ */
+static void pool_adapt(
+	struct pool_data *pool) {
+	uint64_t now = trace_now();
+	double rate = now > pool->adapt_start ? (double) pool->adapt_pairs / (now - pool->adapt_start) : 0;
+	if (pool->probing) {
+		pool->probing = false;
+		if (rate < pool->settled_rate * (1 + ADAPT_GAIN)) {
+			pool_set_active(pool, pool->settled_active);
+			pool->grow = !pool->grow;
+			pool->hold = ADAPT_HOLD;
+		}
+	} else if (pool->hold > 0) {
+		pool->hold--;
+	} else if (pool->workers_length > 1) {
+		if (pool->grow ? pool->active == pool->workers_length : pool->active == 1) {
+			pool->grow = !pool->grow;
+		}
+		pool->settled_rate = rate;
+		pool->settled_active = pool->active;
+		pool->probing = true;
+		pool_set_active(pool, pool->grow ? pool->active + 1 : pool->active - 1);
+	}
+	pool->adapt_pairs = 0;
+	pool->adapt_start = now;
+}
+
+/*
+ * Mark a worker's job as finished. The caller must hold the reader lock.
+ */
+static void pool_stop(
+	struct pool_data *pool,
+	struct pool_worker *worker) {
+	worker->running = false;
+	if (--pool->running == 0) {
+		pthread_cond_broadcast(&pool->finished_cond);
+	}
+}
+#endif
+
+/*
+ * Read the next pair into a slot. The reader reuses its buffers, so the
+ * sequences are copied while it is still locked.
+ */
+static bool pool_read(
+	struct pool_worker *worker,
+	struct pool_slot *slot,
+	panda_seq_identifier *id,
+	size_t *forward_length,
+	size_t *reverse_length,
+	size_t *ordinal) {
+	struct pool_data *pool = worker->pool;
+	const panda_qual *forward;
+	const panda_qual *reverse;
+	bool result;
+#ifdef HAVE_PTHREAD
+	TRACE_BEGIN(lock_start);
+	pthread_mutex_lock(&pool->next_mutex);
+	TRACE_END(TRACE_READER_LOCK, lock_start);
+	if (pool->adaptive && worker->index >= pool->active) {
+		/* This worker has been stopped, so end its job and give its thread to decompression. */
+		pool_stop(pool, worker);
+		pthread_mutex_unlock(&pool->next_mutex);
+		return false;
+	}
+#endif
+	result = !pool->done && pool->next(id, &forward, forward_length, &reverse, reverse_length, pool->next_data);
+	if (result) {
+		memcpy(slot->forward, forward, *forward_length * sizeof(panda_qual));
+		memcpy(slot->reverse, reverse, *reverse_length * sizeof(panda_qual));
+		*ordinal = panda_sam_reader_ordinal(pool->next_data);
+	} else {
+		pool->done = true;
+	}
+#ifdef HAVE_PTHREAD
+	if (pool->adaptive) {
+		if (!result) {
+			pool_stop(pool, worker);
+		} else if (++pool->adapt_pairs >= ADAPT_INTERVAL) {
+			pool_adapt(pool);
+		}
+	}
+	pthread_mutex_unlock(&pool->next_mutex);
+#endif
+	return result;
+}
+
+/*
+ * Write every result that is now in order. The caller must hold the output lock.
+ */
+static void pool_release(
+	struct pool_data *pool) {
+	struct pool_slot *slot;
+	while ((slot = pool->pending[pool->released % pool->pending_length]) != NULL && slot->ready) {
+		pool->pending[pool->released % pool->pending_length] = NULL;
+		if (slot->result != NULL) {
+			TRACE_BEGIN(start);
+			if (!pool->output(slot->result, pool->output_data)) {
+				pool->ok = false;
+			}
+			TRACE_END(TRACE_WRITE, start);
+		}
+		slot->result = NULL;
+		slot->ready = false;
+		slot->busy = false;
+		pool->released++;
+	}
+}
+
+static void *pool_run(
+	struct pool_worker *worker) {
+	struct pool_data *pool = worker->pool;
+	panda_seq_identifier id;
+	size_t forward_length;
+	size_t reverse_length;
+	size_t ordinal;
+	size_t it;
+
+	while (true) {
+		struct pool_slot *slot = NULL;
+#ifdef HAVE_PTHREAD
+		TRACE_BEGIN(lock_start);
+		pthread_mutex_lock(&pool->output_mutex);
+		TRACE_END(TRACE_WRITER_LOCK, lock_start);
+#endif
+		while (slot == NULL) {
+			for (it = 0; it < worker->slots_length; it++) {
+				if (!worker->slots[it].busy) {
+					slot = &worker->slots[it];
+					break;
+				}
+			}
+#ifdef HAVE_PTHREAD
+			if (slot == NULL) {
+				TRACE_BEGIN(wait_start);
+				pthread_cond_wait(&pool->released_cond, &pool->output_mutex);
+				TRACE_END(TRACE_WRITER_WAIT, wait_start);
+			}
+#endif
+		}
+		slot->busy = true;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&pool->output_mutex);
+#endif
+
+		if (!pool_read(worker, slot, &id, &forward_length, &reverse_length, &ordinal)) {
+			/* A stopped worker can be restarted as soon as it has read, so the slot is released where a new job would look for it. */
+#ifdef HAVE_PTHREAD
+			pthread_mutex_lock(&pool->output_mutex);
+#endif
+			slot->busy = false;
+#ifdef HAVE_PTHREAD
+			pthread_cond_broadcast(&pool->released_cond);
+			pthread_mutex_unlock(&pool->output_mutex);
+#endif
+			break;
+		}
+		TRACE_BEGIN(start);
+		slot->result = panda_assembler_assemble(slot->assembler, &id, slot->forward, forward_length, slot->reverse, reverse_length);
+		TRACE_END(TRACE_ASSEMBLE, start);
+
+		if (!pool->ordered) {
+			/* The writers are thread-safe, so the result can go straight out. */
+			if (slot->result != NULL) {
+				TRACE_BEGIN(write_start);
+				if (!pool->output(slot->result, pool->output_data)) {
+					pool->ok = false;
+				}
+				TRACE_END(TRACE_WRITE, write_start);
+			}
+			slot->busy = false;
+			continue;
+		}
+#ifdef HAVE_PTHREAD
+		TRACE_BEGIN(output_lock_start);
+		pthread_mutex_lock(&pool->output_mutex);
+		TRACE_END(TRACE_WRITER_LOCK, output_lock_start);
+#endif
+		slot->ready = true;
+		pool->pending[ordinal % pool->pending_length] = slot;
+		pool_release(pool);
+#ifdef HAVE_PTHREAD
+		pthread_cond_broadcast(&pool->released_cond);
+		pthread_mutex_unlock(&pool->output_mutex);
+#endif
+	}
+	return NULL;
+}
+
+static bool pool_execute(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	bool ordered,
+	bool adaptive,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy) {
+	struct pool_data pool;
+	struct pool_worker *workers;
+	size_t workers_length;
+	size_t it;
+	size_t slot;
+#ifdef HAVE_PTHREAD
+	size_t started;
+#endif
+
+#ifdef HAVE_PTHREAD
+	workers_length = (mux == NULL || threads < 1) ? 1 : (size_t) threads;
+	/* When balancing, one thread of the budget is always left to decompress, or the reader could wait forever. */
+	adaptive = adaptive && workers_length > 1;
+	if (adaptive) {
+		workers_length--;
+	}
+#else
+	adaptive = false;
+	(void) mux;
+	(void) threads;
+	workers_length = 1;
+#endif
+	pool.next = next;
+	pool.next_data = next_data;
+	pool.output = output;
+	pool.output_data = output_data;
+	pool.ordered = ordered;
+	pool.ok = true;
+	pool.done = false;
+	pool.adaptive = false;
+	pool.active = workers_length;
+	pool.workers_length = workers_length;
+	pool.threads = NULL;
+	pool.jobs = NULL;
+	pool.running = 0;
+	pool.adapt_pairs = 0;
+	pool.adapt_start = 0;
+	pool.probing = false;
+	pool.grow = true;
+	pool.hold = 0;
+	pool.settled_rate = 0;
+	pool.settled_active = 0;
+	pool.released = 0;
+	pool.pending_length = workers_length == 1 ? 1 : workers_length * POOL_DEPTH;
+	pool.pending = calloc(pool.pending_length, sizeof(struct pool_slot *));
+	pool.workers = workers = calloc(workers_length, sizeof(struct pool_worker));
+	if (pool.pending == NULL || workers == NULL) {
+		free(pool.pending);
+		free(workers);
+		pool.ok = false;
+		goto cleanup;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&pool.next_mutex, NULL);
+	pthread_mutex_init(&pool.output_mutex, NULL);
+	pthread_cond_init(&pool.released_cond, NULL);
+	pthread_cond_init(&pool.finished_cond, NULL);
+	if (adaptive) {
+		/*
+		 * Decompression and assembly share one pool of the requested size. The
+		 * reader owns it, since it must outlive the file.
+		 */
+		pool.threads = hts_tpool_init(threads);
+		if (pool.threads != NULL) {
+			pool.jobs = hts_tpool_process_init(pool.threads, (int) workers_length, 1);
+		}
+		if (pool.jobs != NULL && ps_set_thread_pool(next_data, pool.threads)) {
+			pool.adaptive = true;
+		} else {
+			/* Fall back to assembling without balancing. */
+			if (pool.jobs != NULL) {
+				hts_tpool_process_destroy(pool.jobs);
+				pool.jobs = NULL;
+			}
+			if (pool.threads != NULL) {
+				hts_tpool_destroy(pool.threads);
+				pool.threads = NULL;
+			}
+		}
+	}
+#endif
+
+	for (it = 0; it < workers_length; it++) {
+		workers[it].pool = &pool;
+		workers[it].index = it;
+		workers[it].running = false;
+		workers[it].slots_length = (ordered && workers_length > 1) ? POOL_DEPTH : 1;
+		for (slot = 0; slot < workers[it].slots_length; slot++) {
+#ifdef HAVE_PTHREAD
+			if (it == 0 && slot == 0) {
+				workers[it].slots[slot].assembler = assembler;
+			} else {
+				workers[it].slots[slot].assembler = panda_mux_create_assembler(mux);
+				panda_assembler_copy_configuration(workers[it].slots[slot].assembler, assembler);
+			}
+#else
+			workers[it].slots[slot].assembler = assembler;
+#endif
+		}
+	}
+#ifdef HAVE_PTHREAD
+	if (pool.adaptive) {
+		/* Start with the threads split evenly and let balancing move them. */
+		pthread_mutex_lock(&pool.next_mutex);
+		pool.adapt_start = trace_now();
+		pool_set_active(&pool, threads / 2 < 1 ? 1 : (size_t) threads / 2);
+		if (pool.running == 0) {
+			pool.ok = false;
+		}
+		while (pool.running > 0) {
+			pthread_cond_wait(&pool.finished_cond, &pool.next_mutex);
+		}
+		pthread_mutex_unlock(&pool.next_mutex);
+		hts_tpool_process_flush(pool.jobs);
+		hts_tpool_process_destroy(pool.jobs);
+		goto finished;
+	}
+	for (started = 1; started < workers_length; started++) {
+		if (pthread_create(&workers[started].thread, NULL, (void *(*)(void *)) pool_run, &workers[started]) != 0) {
+			break;
+		}
+	}
+	if (started < workers_length) {
+		/* Carry on with the threads there are; the others' assemblers sit idle. */
+		pthread_mutex_lock(&pool.next_mutex);
+		pool.workers_length = started;
+		if (pool.active > started) {
+			pool.active = started;
+		}
+		pthread_mutex_unlock(&pool.next_mutex);
+	}
+#endif
+	pool_run(&workers[0]);
+#ifdef HAVE_PTHREAD
+	for (it = 1; it < started; it++) {
+		pthread_join(workers[it].thread, NULL);
+	}
+      finished:
+#endif
+	for (it = 0; it < workers_length; it++) {
+		for (slot = 0; slot < workers[it].slots_length; slot++) {
+			if (it != 0 || slot != 0) {
+				panda_assembler_unref(workers[it].slots[slot].assembler);
+			}
+		}
+	}
+#ifdef HAVE_PTHREAD
+	pthread_cond_destroy(&pool.finished_cond);
+	pthread_cond_destroy(&pool.released_cond);
+	pthread_mutex_destroy(&pool.output_mutex);
+	pthread_mutex_destroy(&pool.next_mutex);
+#endif
+	free(pool.pending);
+	free(workers);
+      cleanup:
+	panda_assembler_unref(assembler);
+#ifdef HAVE_PTHREAD
+	if (mux != NULL) {
+		panda_mux_unref(mux);
+	}
+#endif
+	if (output_destroy != NULL) {
+		output_destroy(output_data);
+	}
+	return pool.ok;
+}
+
+bool panda_sam_run_pool(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy) {
+	return pool_execute(threads, assembler, mux, next, next_data, false, false, output, output_data, output_destroy);
+}
+
+bool panda_sam_run_pool_ordered(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy) {
+	return pool_execute(threads, assembler, mux, next, next_data, true, false, output, output_data, output_destroy);
+}
+
+bool panda_sam_run_pool_adaptive(
+	int threads,
+	PandaAssembler assembler,
+	PandaMux mux,
+	PandaNextSeq next,
+	void *next_data,
+	bool ordered,
+	PandaOutputSeq output,
+	void *output_data,
+	PandaDestroy output_destroy) {
+	return pool_execute(threads, assembler, mux, next, next_data, ordered, true, output, output_data, output_destroy);
+}
@@ -18,17 +18,54 @@
 
 #include "config.h"
 #include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#        include <emmintrin.h>
+#endif
 
 #include "pandaseq-sam.h"
+#include "reader.h"
+#include "trace.h"
+#include <htslib/hfile.h>
 #include <htslib/hts.h>
 #include <htslib/khash.h>
 #include <htslib/sam.h>
 
+/* The longest UMI that will be considered. */
+#define UMI_MAX_LEN 64
+/* The highest quality score a consensus base can have. */
+#define UMI_MAX_QUAL 40
+
+/* The sum of the quality scores supporting A, C, G and T at each position. */
+struct umi_votes {
+	uint32_t forward[PANDA_MAX_LEN][4];
+	uint32_t reverse[PANDA_MAX_LEN][4];
+};
+
+struct umi_family {
+	struct umi_family *next;
+	char *umi;
+	panda_seq_identifier id;
+	size_t size;
+	size_t forward_length;
+	size_t reverse_length;
+	/* Most families are a single pair, so there are no votes until a second pair joins. */
+	struct umi_votes *votes;
+	/* The first pair, forward then reverse, which is passed through unchanged if no others join it. */
+	size_t first_forward_length;
+	size_t first_reverse_length;
+	panda_qual first[];
+};
+
 KHASH_MAP_INIT_STR(seq, bam1_t *)
+KHASH_MAP_INIT_STR(umi, struct umi_family *)
 
 struct reader_data {
 	htsFile *file;
+	hts_tpool *thread_pool;
 	 khash_t(
 		seq) * pool;
 	PandaLogProxy logger;
@@ -40,8 +77,61 @@ struct reader_data {
 	char tag[PANDA_TAG_LEN];
 	bam_hdr_t *header;
 	FILE *orphan_file;
+	bool filter;
+	size_t filter_max_uncalled;
+	double filter_min_quality;
+	double filter_max_errors;
+	double filter_error_probability[256];
+	size_t filter_rejected[3];
+	PandaFailAlign filter_reject;
+	void *filter_reject_data;
+	PandaDestroy filter_reject_destroy;
+	size_t ordinal;
+	size_t pairs;
+	bool umi_enabled;
+	bool umi_draining;
+	char umi_tag[3];
+	char umi[UMI_MAX_LEN];
+	size_t umi_max_families;
+	 khash_t(
+		umi) * umi_families;
+	/* Open families, oldest first. */
+	struct umi_family *umi_oldest;
+	struct umi_family *umi_newest;
+	size_t shard_index;
+	size_t shard_count;
 };
 
+typedef enum {
+	PREFILTER_UNCALLED,
+	PREFILTER_QUALITY,
+	PREFILTER_ERRORS,
+	PREFILTER_PASS
+} prefilter_result;
+
+static const char *const prefilter_names[] = { "uncalled", "quality", "errors" };
+
+/*
+ * Put a tag followed by a suffix into an identifier's tag, shortening the tag
+ * rather than the suffix if they do not both fit.
+ */
+static void tag_with_suffix(
+	char *target,
+	const char *tag,
+	const char *suffix) {
+	size_t suffix_length = strlen(suffix);
+	size_t tag_length = strlen(tag);
+	if (suffix_length > PANDA_TAG_LEN - 1) {
+		suffix_length = PANDA_TAG_LEN - 1;
+	}
+	if (tag_length > PANDA_TAG_LEN - 1 - suffix_length) {
+		tag_length = PANDA_TAG_LEN - 1 - suffix_length;
+	}
+	memmove(target, tag, tag_length);
+	memcpy(target + tag_length, suffix, suffix_length);
+	target[tag_length + suffix_length] = '\0';
+}
+
 bool ps_fill(
 	bam1_t *bam,
 	panda_qual *seq,
@@ -92,12 +182,134 @@ bool damaged_seq(
 	return false;
 }
 
+/*
+ * Count the uncalled bases in a BAM record. The sequence is packed two bases
+ * per byte and an N is the nibble 15, so both nibbles of every byte can be
+ * compared at once.
+ */
+static size_t count_uncalled(
+	bam1_t *bam) {
+	const uint8_t *packed = bam_get_seq(bam);
+	size_t bytes = bam->core.l_qseq / 2;
+	size_t count = 0;
+	size_t it = 0;
+#ifdef __SSE2__
+	const __m128i high = _mm_set1_epi8((char) 0xF0);
+	const __m128i low = _mm_set1_epi8(0x0F);
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i total = _mm_setzero_si128();
+	for (; it + 16 <= bytes; it += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) (packed + it));
+		__m128i high_n = _mm_cmpeq_epi8(_mm_and_si128(block, high), high);
+		__m128i low_n = _mm_cmpeq_epi8(_mm_and_si128(block, low), low);
+		__m128i hits = _mm_add_epi8(_mm_and_si128(high_n, one), _mm_and_si128(low_n, one));
+		total = _mm_add_epi64(total, _mm_sad_epu8(hits, _mm_setzero_si128()));
+	}
+	count = (size_t) _mm_cvtsi128_si32(total) + (size_t) _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+#endif
+	for (; it < bytes; it++) {
+		count += ((packed[it] & 0xF0) == 0xF0) + ((packed[it] & 0x0F) == 0x0F);
+	}
+	/* An odd-length sequence has one base in the high nibble of the last byte; the low nibble is padding. */
+	if (bam->core.l_qseq % 2 == 1 && (packed[bytes] & 0xF0) == 0xF0) {
+		count++;
+	}
+	return count;
+}
+
+static size_t sum_quality(
+	bam1_t *bam) {
+	const uint8_t *qual = bam_get_qual(bam);
+	size_t length = bam->core.l_qseq;
+	size_t sum = 0;
+	size_t it = 0;
+#ifdef __SSE2__
+	__m128i total = _mm_setzero_si128();
+	for (; it + 16 <= length; it += 16) {
+		total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (qual + it)), _mm_setzero_si128()));
+	}
+	sum = (size_t) _mm_cvtsi128_si32(total) + (size_t) _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+#endif
+	for (; it < length; it++) {
+		sum += qual[it];
+	}
+	return sum;
+}
+
+static double sum_errors(
+	struct reader_data *data,
+	bam1_t *bam) {
+	const uint8_t *qual = bam_get_qual(bam);
+	size_t length = bam->core.l_qseq;
+	double sum = 0;
+	size_t it;
+	for (it = 0; it < length; it++) {
+		sum += data->filter_error_probability[qual[it]];
+	}
+	return sum;
+}
+
+static prefilter_result prefilter(
+	struct reader_data *data,
+	bam1_t *seq,
+	bam1_t *mate) {
+	size_t length = seq->core.l_qseq + mate->core.l_qseq;
+	if (data->filter_max_uncalled != SIZE_MAX && count_uncalled(seq) + count_uncalled(mate) > data->filter_max_uncalled) {
+		return PREFILTER_UNCALLED;
+	}
+	/* A quality of 0xFF means the record has no quality scores, so there is nothing to judge. */
+	if (bam_get_qual(seq)[0] == 0xFF || bam_get_qual(mate)[0] == 0xFF) {
+		return PREFILTER_PASS;
+	}
+	if (data->filter_min_quality > 0 && (double) (sum_quality(seq) + sum_quality(mate)) < data->filter_min_quality * length) {
+		return PREFILTER_QUALITY;
+	}
+	if (data->filter_max_errors < DBL_MAX && sum_errors(data, seq) + sum_errors(data, mate) > data->filter_max_errors) {
+		return PREFILTER_ERRORS;
+	}
+	return PREFILTER_PASS;
+}
+
+/*
+ * Find the UMI of a pair, either in an auxiliary tag or after the last
+ * underscore in the read name. In the latter case, the UMI is removed from the
+ * name so that the rest can be parsed as an Illumina identifier.
+ */
+static void extract_umi(
+	struct reader_data *data,
+	bam1_t *seq,
+	bam1_t *mate) {
+	data->umi[0] = '\0';
+	if (!data->umi_enabled) {
+		return;
+	}
+	if (data->umi_tag[0] == '\0') {
+		char *split = strrchr(bam_get_qname(seq), '_');
+		if (split != NULL && strlen(split + 1) < UMI_MAX_LEN) {
+			strcpy(data->umi, split + 1);
+			*split = '\0';
+		}
+	} else {
+		uint8_t *aux = bam_aux_get(seq, data->umi_tag);
+		if (aux == NULL) {
+			aux = bam_aux_get(mate, data->umi_tag);
+		}
+		if (aux != NULL && *aux == 'Z') {
+			const char *value = bam_aux2Z(aux);
+			if (strlen(value) < UMI_MAX_LEN) {
+				strcpy(data->umi, value);
+			}
+		}
+	}
+}
+
 #define show_flag(flag_value, ch) if (seq->core.flag & flag_value) fputc(ch, data->orphan_file);
 
 void write_orphan(
 	struct reader_data *data,
 	bam1_t *seq,
-	PandaCode seq_err) {
+	PandaCode seq_err,
+	const char *reason) {
 	if (data->orphan_file != NULL) {
 		size_t it;
 		fprintf(data->orphan_file, "@%s", bam_get_qname(seq));
@@ -113,6 +325,9 @@ void write_orphan(
 		show_flag(BAM_FQCFAIL, 'f');
 		show_flag(BAM_FDUP, 'd');
 		show_flag(BAM_FSUPPLEMENTARY, 'S');
+		if (reason != NULL) {
+			fprintf(data->orphan_file, " %s", reason);
+		}
 		fprintf(data->orphan_file, "\n");
 		for (it = 0; it < (size_t) seq->core.l_qseq; it++) {
 			fputc(panda_nt_to_ascii((panda_nt) (bam_seqi(bam_get_seq(seq), it))), data->orphan_file);
@@ -127,25 +342,78 @@ void write_orphan(
 	}
 }
 
-bool ps_next(
+/*
+ * Choose the shard for a read. The key must be the same for both reads in a
+ * pair, or the mates would land in different shards and the pair would be
+ * lost. The name always is. When collapsing by UMI from the name, the UMI is
+ * part of it, so it is used instead to keep families in one shard. A UMI tag
+ * may be on only one of the reads, so it cannot be used.
+ */
+static size_t shard_of(
+	struct reader_data *data,
+	bam1_t *seq) {
+	const char *key = bam_get_qname(seq);
+	uint64_t hash = 14695981039346656037ULL;
+	if (data->umi_enabled && data->umi_tag[0] == '\0') {
+		const char *split = strrchr(key, '_');
+		if (split != NULL) {
+			key = split + 1;
+		}
+	}
+	for (; *key != '\0'; key++) {
+		hash = (hash ^ (uint8_t) *key) * 1099511628211ULL;
+	}
+	return hash % data->shard_count;
+}
+
+static int ps_read(
+	struct reader_data *data,
+	bam1_t *seq) {
+	int res;
+	do {
+		TRACE_BEGIN(start);
+		res = sam_read1(data->file, data->header, seq);
+		TRACE_END(TRACE_READ, start);
+	} while (res >= 0 && data->shard_count > 1 && shard_of(data, seq) != data->shard_index);
+	return res;
+}
+
+/*
+ * Fill the forward and reverse buffers from a pair. The reads must be in
+ * opposite orientations, or the pair is malformed.
+ */
+static bool ps_fill_pair(
+	struct reader_data *data,
+	bam1_t *seq,
+	bam1_t *mate) {
+	bool swapped;
+	TRACE_BEGIN(start);
+	if (seq->core.flag & BAM_FREAD1) {
+		swapped = ps_fill(seq, data->forward, &data->forward_length);
+		swapped ^= ps_fill(mate, data->reverse, &data->reverse_length);
+	} else {
+		swapped = ps_fill(mate, data->forward, &data->forward_length);
+		swapped ^= ps_fill(seq, data->reverse, &data->reverse_length);
+	}
+	TRACE_END(TRACE_FILL, start);
+	return swapped;
+}
+
+/*
+ * Read the next pair into the forward and reverse buffers.
+ */
+static bool ps_next_pair(
 	panda_seq_identifier *id,
-	panda_qual **forward,
-	size_t *forward_length,
-	panda_qual **reverse,
-	size_t *reverse_length,
 	struct reader_data *data) {
 	int res;
 	khiter_t key;
 	bam1_t *seq = bam_init1();
 
-	*forward = NULL;
-	*forward_length = 0;
-	*reverse = NULL;
-	*reverse_length = 0;
-	while ((res = sam_read1(data->file, data->header, seq)) >= 0) {
+	while ((res = ps_read(data, seq)) >= 0) {
 		PandaCode seq_err;
+		TRACE_BEGIN(pair_start);
 		if (damaged_seq(seq, &seq_err)) {
-			write_orphan(data, seq, seq_err);
+			write_orphan(data, seq, seq_err, NULL);
 			continue;
 		}
 		key = kh_get(seq, data->pool, bam_get_qname(seq));
@@ -162,11 +430,15 @@ bool ps_next(
 			}
 			kh_value(data->pool, key) = seq;
 			seq = bam_init1();
+			TRACE_END(TRACE_PAIR, pair_start);
 		} else {
-			bool swapped;
+			prefilter_result filtered;
 			bam1_t *mate = kh_value(data->pool, key);
 			kh_del(seq, data->pool, key);
+			TRACE_END(TRACE_PAIR, pair_start);
 
+			TRACE_BEGIN(parse_start);
+			extract_umi(data, seq, mate);
 			if (!panda_seqid_parse_sam(id, bam_get_qname(seq))) {
 				if (panda_debug_flags & PANDA_DEBUG_FILE) {
 					panda_log_proxy_write(data->logger, PANDA_CODE_ID_PARSE_FAILURE, NULL, NULL, bam_get_qname(seq));
@@ -176,27 +448,41 @@ bool ps_next(
 				return false;
 			}
 			memcpy(id->tag, data->tag, data->tag_length + 1);
+			TRACE_END(TRACE_PARSE, parse_start);
 
-			if (seq->core.flag & BAM_FREAD1) {
-				swapped = ps_fill(seq, data->forward, &data->forward_length);
-				swapped ^= ps_fill(mate, data->reverse, &data->reverse_length);
-			} else {
-				swapped = ps_fill(mate, data->forward, &data->forward_length);
-				swapped ^= ps_fill(seq, data->reverse, &data->reverse_length);
-			}
-			if (!swapped) {
+			filtered = data->filter ? prefilter(data, seq, mate) : PREFILTER_PASS;
+			/* Rejected pairs only need converting if they are going somewhere. */
+			if ((filtered == PREFILTER_PASS || data->filter_reject != NULL) && !ps_fill_pair(data, seq, mate)) {
 				panda_log_proxy_write(data->logger, PANDA_CODE_PARSE_FAILURE, NULL, NULL, bam_get_qname(seq));
 				bam_destroy1(seq);
 				bam_destroy1(mate);
 				return false;
 			}
+			if (filtered != PREFILTER_PASS) {
+				data->filter_rejected[filtered]++;
+				if (panda_debug_flags & PANDA_DEBUG_FILE) {
+					panda_log_proxy_write_f(data->logger, "PREFILTER\t%s\t%s", prefilter_names[filtered], bam_get_qname(seq));
+				}
+				if (data->filter_reject != NULL) {
+					/* Mark the reason in the tag, so these can be told apart from pairs the assembler could not align. */
+					panda_seq_identifier reject_id = *id;
+					char suffix[PANDA_TAG_LEN];
+					strcpy(suffix, ";prefilter=");
+					strcat(suffix, prefilter_names[filtered]);
+					tag_with_suffix(reject_id.tag, id->tag, suffix);
+					data->filter_reject(NULL, &reject_id, data->forward, data->forward_length, data->reverse, data->reverse_length, data->filter_reject_data);
+				} else if (data->orphan_file != NULL) {
+					write_orphan(data, mate, PANDA_CODE_LOW_QUALITY_REJECT, prefilter_names[filtered]);
+					write_orphan(data, seq, PANDA_CODE_LOW_QUALITY_REJECT, prefilter_names[filtered]);
+				}
+				bam_destroy1(mate);
+				bam_destroy1(seq);
+				seq = bam_init1();
+				continue;
+			}
 
 			bam_destroy1(seq);
 			bam_destroy1(mate);
-			*forward = data->forward;
-			*forward_length = data->forward_length;
-			*reverse = data->reverse;
-			*reverse_length = data->reverse_length;
 			return true;
 		}
 	}
@@ -208,19 +494,241 @@ bool ps_next(
 	return false;
 }
 
+static void umi_add(
+	uint32_t (*weights)[4],
+	size_t *weights_length,
+	const panda_qual *seq,
+	size_t seq_length) {
+	size_t it;
+	/* Quality scores are raw BAM bytes; 0xFF means the record has none, so each base gets a single vote. */
+	bool has_quality = seq_length == 0 || (uint8_t) seq[0].qual != 0xFF;
+	for (it = 0; it < seq_length; it++) {
+		uint32_t weight = has_quality ? (uint8_t) seq[it].qual : 1;
+		switch (seq[it].nt) {
+		case 1:
+			weights[it][0] += weight;
+			break;
+		case 2:
+			weights[it][1] += weight;
+			break;
+		case 4:
+			weights[it][2] += weight;
+			break;
+		case 8:
+			weights[it][3] += weight;
+			break;
+		default:
+			break;
+		}
+	}
+	if (seq_length > *weights_length) {
+		*weights_length = seq_length;
+	}
+}
+
+/*
+ * Call the base at each position by quality-weighted vote. The consensus
+ * quality is the support for the winning base less the support for the rest.
+ */
+static void umi_consensus(
+	uint32_t (*weights)[4],
+	size_t length,
+	panda_qual *seq) {
+	size_t it;
+	size_t nt;
+	for (it = 0; it < length; it++) {
+		size_t best = 0;
+		uint32_t total = weights[it][0];
+		for (nt = 1; nt < 4; nt++) {
+			total += weights[it][nt];
+			if (weights[it][nt] > weights[it][best]) {
+				best = nt;
+			}
+		}
+		if (weights[it][best] == 0) {
+			seq[it].nt = (panda_nt) 15;
+			seq[it].qual = 0;
+		} else {
+			int64_t qual = 2 * (int64_t) weights[it][best] - total;
+			seq[it].nt = (panda_nt) (1 << best);
+			seq[it].qual = qual < 0 ? 0 : qual > UMI_MAX_QUAL ? UMI_MAX_QUAL : qual;
+		}
+	}
+}
+
+/*
+ * Fold the pair just read into the open family for its UMI.
+ */
+static bool umi_collect(
+	struct reader_data *data,
+	panda_seq_identifier *id) {
+	struct umi_family *family;
+	khiter_t key = kh_get(umi, data->umi_families, data->umi);
+	if (key == kh_end(data->umi_families)) {
+		int ret;
+		family = malloc(sizeof(struct umi_family) + (data->forward_length + data->reverse_length) * sizeof(panda_qual));
+		if (family == NULL) {
+			return false;
+		}
+		family->umi = malloc(strlen(data->umi) + 1);
+		if (family->umi == NULL) {
+			free(family);
+			return false;
+		}
+		strcpy(family->umi, data->umi);
+		key = kh_put(umi, data->umi_families, family->umi, &ret);
+		if (ret == -1) {
+			free(family->umi);
+			free(family);
+			return false;
+		}
+		kh_value(data->umi_families, key) = family;
+		family->next = NULL;
+		family->id = *id;
+		family->size = 1;
+		family->votes = NULL;
+		family->forward_length = family->first_forward_length = data->forward_length;
+		family->reverse_length = family->first_reverse_length = data->reverse_length;
+		memcpy(family->first, data->forward, data->forward_length * sizeof(panda_qual));
+		memcpy(family->first + data->forward_length, data->reverse, data->reverse_length * sizeof(panda_qual));
+		if (data->umi_newest == NULL) {
+			data->umi_oldest = family;
+		} else {
+			data->umi_newest->next = family;
+		}
+		data->umi_newest = family;
+		return true;
+	}
+	family = kh_value(data->umi_families, key);
+	if (family->votes == NULL) {
+		family->votes = calloc(1, sizeof(struct umi_votes));
+		if (family->votes == NULL) {
+			return false;
+		}
+		umi_add(family->votes->forward, &family->forward_length, family->first, family->first_forward_length);
+		umi_add(family->votes->reverse, &family->reverse_length, family->first + family->first_forward_length, family->first_reverse_length);
+	}
+	family->size++;
+	umi_add(family->votes->forward, &family->forward_length, data->forward, data->forward_length);
+	umi_add(family->votes->reverse, &family->reverse_length, data->reverse, data->reverse_length);
+	return true;
+}
+
+/*
+ * Close the oldest family and put its consensus in the forward and reverse
+ * buffers. A family of one is passed through as it was read.
+ */
+static bool umi_emit(
+	struct reader_data *data,
+	panda_seq_identifier *id) {
+	struct umi_family *family = data->umi_oldest;
+	char suffix[32];
+	if (family == NULL) {
+		return false;
+	}
+	data->umi_oldest = family->next;
+	if (data->umi_oldest == NULL) {
+		data->umi_newest = NULL;
+	}
+	kh_del(umi, data->umi_families, kh_get(umi, data->umi_families, family->umi));
+
+	*id = family->id;
+	snprintf(suffix, sizeof(suffix), ";size=%zu", family->size);
+	tag_with_suffix(id->tag, data->tag, suffix);
+	if (family->votes == NULL) {
+		memcpy(data->forward, family->first, family->first_forward_length * sizeof(panda_qual));
+		memcpy(data->reverse, family->first + family->first_forward_length, family->first_reverse_length * sizeof(panda_qual));
+	} else {
+		umi_consensus(family->votes->forward, family->forward_length, data->forward);
+		umi_consensus(family->votes->reverse, family->reverse_length, data->reverse);
+	}
+	data->forward_length = family->forward_length;
+	data->reverse_length = family->reverse_length;
+	free(family->votes);
+	free(family->umi);
+	free(family);
+	return true;
+}
+
+bool ps_next(
+	panda_seq_identifier *id,
+	panda_qual **forward,
+	size_t *forward_length,
+	panda_qual **reverse,
+	size_t *reverse_length,
+	struct reader_data *data) {
+
+	*forward = NULL;
+	*forward_length = 0;
+	*reverse = NULL;
+	*reverse_length = 0;
+	if (!data->umi_enabled) {
+		if (!ps_next_pair(id, data)) {
+			return false;
+		}
+	} else {
+		/* Keep collecting until too many families are open or the input runs out. */
+		while (true) {
+			if (data->umi_draining) {
+				if (!umi_emit(data, id)) {
+					return false;
+				}
+				break;
+			}
+			if (!ps_next_pair(id, data)) {
+				data->umi_draining = true;
+				continue;
+			}
+			if (data->umi[0] == '\0') {
+				break;
+			}
+			if (!umi_collect(data, id)) {
+				return false;
+			}
+			if (kh_size(data->umi_families) > data->umi_max_families) {
+				umi_emit(data, id);
+				break;
+			}
+		}
+	}
+	*forward = data->forward;
+	*forward_length = data->forward_length;
+	*reverse = data->reverse;
+	*reverse_length = data->reverse_length;
+	data->ordinal = data->pairs++;
+	return true;
+}
+
 void ps_destroy(
 	struct reader_data *data) {
 	khiter_t key;
 	bam_hdr_destroy(data->header);
 	hts_close(data->file);
+	if (data->thread_pool != NULL) {
+		hts_tpool_destroy(data->thread_pool);
+	}
 	for (key = kh_begin(data->pool); key != kh_end(data->pool); key++) {
 		if (kh_exist(data->pool, key)) {
 			bam1_t *seq = kh_value(data->pool, key);
-			write_orphan(data, seq, PANDA_CODE_PARSE_FAILURE);
+			write_orphan(data, seq, PANDA_CODE_PARSE_FAILURE, NULL);
 			bam_destroy1(seq);
 		}
 	}
 	kh_destroy(seq, data->pool);
+	while (data->umi_oldest != NULL) {
+		struct umi_family *family = data->umi_oldest;
+		data->umi_oldest = family->next;
+		free(family->votes);
+		free(family->umi);
+		free(family);
+	}
+	kh_destroy(umi, data->umi_families);
+	if (data->filter) {
+		panda_log_proxy_write_f(data->logger, "STAT\tPREFILTER\t%zu\t%zu\t%zu", data->filter_rejected[PREFILTER_UNCALLED], data->filter_rejected[PREFILTER_QUALITY], data->filter_rejected[PREFILTER_ERRORS]);
+	}
+	if (data->filter_reject_destroy != NULL) {
+		data->filter_reject_destroy(data->filter_reject_data);
+	}
 	panda_log_proxy_unref(data->logger);
 	if (data->orphan_file != NULL) {
 		fclose(data->orphan_file);
@@ -230,10 +738,12 @@ void ps_destroy(
 	free(data);
 }
 
-PandaNextSeq panda_create_sam_reader_ex(
-	const char *filename,
+/*
+ * Create a reader around an open file. The file is closed on failure.
+ */
+static PandaNextSeq ps_create(
+	htsFile *file,
 	PandaLogProxy logger,
-	bool binary,
 	const char *tag,
 	const char *orphan_file,
 	void **user_data,
@@ -243,30 +753,31 @@ PandaNextSeq panda_create_sam_reader_ex(
 	*destroy = NULL;
 	*user_data = NULL;
 
+	if (file == NULL) {
+		return NULL;
+	}
 	data = malloc(sizeof(struct reader_data));
 	if (data == NULL) {
+		hts_close(file);
 		return NULL;
 	}
 	data->forward = calloc(PANDA_MAX_LEN, sizeof(panda_qual));
 	if (data->forward == NULL) {
+		hts_close(file);
 		free(data);
 		return NULL;
 	}
 
 	data->reverse = calloc(PANDA_MAX_LEN, sizeof(panda_qual));
 	if (data->reverse == NULL) {
+		hts_close(file);
 		free(data->forward);
 		free(data);
 		return NULL;
 	}
 
-	data->file = hts_open(filename, binary ? "rb" : "r");
-	if (data->file == NULL) {
-		free(data->forward);
-		free(data->reverse);
-		free(data);
-		return NULL;
-	}
+	data->file = file;
+	data->thread_pool = NULL;
 	if (tag == NULL) {
 		data->tag_length = 0;
 		data->tag[0] = '\0';
@@ -298,6 +809,26 @@ PandaNextSeq panda_create_sam_reader_ex(
 			return NULL;
 		}
 	}
+	data->filter = false;
+	data->filter_max_uncalled = SIZE_MAX;
+	data->filter_min_quality = 0;
+	data->filter_max_errors = DBL_MAX;
+	memset(data->filter_rejected, 0, sizeof(data->filter_rejected));
+	data->filter_reject = NULL;
+	data->filter_reject_data = NULL;
+	data->filter_reject_destroy = NULL;
+	data->ordinal = 0;
+	data->pairs = 0;
+	data->umi_enabled = false;
+	data->umi_draining = false;
+	data->umi_tag[0] = '\0';
+	data->umi[0] = '\0';
+	data->umi_max_families = 0;
+	data->umi_families = kh_init(umi);
+	data->umi_oldest = NULL;
+	data->umi_newest = NULL;
+	data->shard_index = 0;
+	data->shard_count = 1;
 	data->pool = kh_init(seq);
 	data->header = sam_hdr_read(data->file);
 	data->logger = panda_log_proxy_ref(logger);
@@ -305,3 +836,310 @@ PandaNextSeq panda_create_sam_reader_ex(
 	*user_data = data;
 	return (PandaNextSeq) ps_next;
 }
+
+PandaNextSeq panda_create_sam_reader_ex(
+	const char *filename,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy) {
+	return ps_create(hts_open(filename, binary ? "rb" : "r"), logger, tag, orphan_file, user_data, destroy);
+}
+
+/*
+ * Wrap an hFILE as a SAM/BAM file. Unlike hts_open, hts_hopen leaves the hFILE open on failure.
+ */
+static htsFile *ps_hopen(
+	hFILE *hfile,
+	const char *name,
+	bool binary) {
+	htsFile *file;
+	if (hfile == NULL) {
+		return NULL;
+	}
+	file = hts_hopen(hfile, name, binary ? "rb" : "r");
+	if (file == NULL) {
+		hclose_abruptly(hfile);
+	}
+	return file;
+}
+
+PandaNextSeq panda_create_sam_reader_fd(
+	int fd,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy) {
+	hFILE *hfile = hdopen(fd, "r");
+	if (hfile == NULL) {
+		/* The descriptor belongs to the reader even if it could not be wrapped. */
+		close(fd);
+	}
+	return ps_create(ps_hopen(hfile, "-", binary), logger, tag, orphan_file, user_data, destroy);
+}
+
+/*
+ * htslib does not install the header for writing hFILE backends, though the
+ * functions are exported for plugins, so the declarations are repeated here.
+ * configure checks that they are present.
+ */
+struct hFILE_backend {
+	ssize_t (*read) (hFILE *fp, void *buffer, size_t nbytes);
+	ssize_t (*write) (hFILE *fp, const void *buffer, size_t nbytes);
+	off_t (*seek) (hFILE *fp, off_t offset, int whence);
+	int (*flush) (hFILE *fp);
+	int (*close) (hFILE *fp);
+};
+hFILE *hfile_init(
+	size_t struct_size,
+	const char *mode,
+	size_t capacity);
+
+static off_t buffer_seek(
+	hFILE *fp,
+	off_t offset,
+	int whence) {
+	(void) fp;
+	(void) offset;
+	(void) whence;
+	errno = ESPIPE;
+	return -1;
+}
+
+#ifdef HAVE_HFILE_INIT_FIXED
+hFILE *hfile_init_fixed(
+	size_t struct_size,
+	const char *mode,
+	char *buffer,
+	size_t buf_filled,
+	size_t buf_size);
+
+/*
+ * A memory buffer is used directly as the hFILE's buffer, so it is never
+ * copied. The buffer already holds everything, so reading more is always the
+ * end of the file and seeking within the buffer is handled by hFILE itself.
+ */
+static ssize_t buffer_read(
+	hFILE *fp,
+	void *buffer,
+	size_t nbytes) {
+	(void) fp;
+	(void) buffer;
+	(void) nbytes;
+	return 0;
+}
+
+static int buffer_close(
+	hFILE *fp) {
+	/* The buffer belongs to the caller; stop hclose from freeing it. */
+	fp->buffer = NULL;
+	return 0;
+}
+
+static const struct hFILE_backend buffer_backend = { buffer_read, NULL, buffer_seek, NULL, buffer_close };
+
+PandaNextSeq panda_create_sam_reader_buffer(
+	const void *buffer,
+	size_t length,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy) {
+	hFILE *hfile = hfile_init_fixed(sizeof(hFILE), "r", (char *) buffer, length, length);
+	if (hfile != NULL) {
+		hfile->backend = &buffer_backend;
+	}
+	return ps_create(ps_hopen(hfile, "-", binary), logger, tag, orphan_file, user_data, destroy);
+}
+#else
+/*
+ * Without hfile_init_fixed, the hFILE has its own buffer and the memory buffer
+ * is copied into it as htslib reads, one block at a time.
+ */
+struct buffer_hfile {
+	hFILE base;
+	const char *data;
+	size_t length;
+	size_t position;
+};
+
+static ssize_t buffer_read(
+	struct buffer_hfile *fp,
+	void *buffer,
+	size_t nbytes) {
+	if (nbytes > fp->length - fp->position) {
+		nbytes = fp->length - fp->position;
+	}
+	memcpy(buffer, fp->data + fp->position, nbytes);
+	fp->position += nbytes;
+	return nbytes;
+}
+
+static int buffer_close(
+	struct buffer_hfile *fp) {
+	(void) fp;
+	return 0;
+}
+
+static const struct hFILE_backend buffer_backend = { (ssize_t (*)(hFILE *, void *, size_t)) buffer_read, NULL, buffer_seek, NULL, (int (*)(hFILE *)) buffer_close };
+
+PandaNextSeq panda_create_sam_reader_buffer(
+	const void *buffer,
+	size_t length,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy) {
+	struct buffer_hfile *hfile = (struct buffer_hfile *) hfile_init(sizeof(struct buffer_hfile), "r", 0);
+	if (hfile != NULL) {
+		hfile->base.backend = &buffer_backend;
+		hfile->data = buffer;
+		hfile->length = length;
+		hfile->position = 0;
+	}
+	return ps_create(ps_hopen(hfile == NULL ? NULL : &hfile->base, "-", binary), logger, tag, orphan_file, user_data, destroy);
+}
+#endif
+
+struct stream_hfile {
+	hFILE base;
+	PandaBufferRead read;
+	void *read_data;
+	PandaDestroy read_destroy;
+};
+
+static ssize_t stream_read(
+	struct stream_hfile *fp,
+	void *buffer,
+	size_t nbytes) {
+	size_t read = 0;
+	if (!fp->read(buffer, nbytes, &read, fp->read_data)) {
+		errno = EIO;
+		return -1;
+	}
+	return read;
+}
+
+static int stream_close(
+	struct stream_hfile *fp) {
+	if (fp->read_destroy != NULL) {
+		fp->read_destroy(fp->read_data);
+	}
+	return 0;
+}
+
+static const struct hFILE_backend stream_backend = { (ssize_t (*)(hFILE *, void *, size_t)) stream_read, NULL, buffer_seek, NULL, (int (*)(hFILE *)) stream_close };
+
+PandaNextSeq panda_create_sam_reader_stream(
+	PandaBufferRead read,
+	void *read_data,
+	PandaDestroy read_destroy,
+	PandaLogProxy logger,
+	bool binary,
+	const char *tag,
+	const char *orphan_file,
+	void **user_data,
+	PandaDestroy *destroy) {
+	struct stream_hfile *hfile = (struct stream_hfile *) hfile_init(sizeof(struct stream_hfile), "r", 0);
+	if (hfile == NULL) {
+		if (read_destroy != NULL) {
+			read_destroy(read_data);
+		}
+		*user_data = NULL;
+		*destroy = NULL;
+		return NULL;
+	}
+	hfile->base.backend = &stream_backend;
+	hfile->read = read;
+	hfile->read_data = read_data;
+	hfile->read_destroy = read_destroy;
+	return ps_create(ps_hopen(&hfile->base, "-", binary), logger, tag, orphan_file, user_data, destroy);
+}
+
+void panda_sam_reader_set_prefilter(
+	void *user_data,
+	size_t max_uncalled,
+	double min_quality,
+	double max_errors,
+	PandaFailAlign reject,
+	void *reject_data,
+	PandaDestroy reject_destroy) {
+	struct reader_data *data = user_data;
+	size_t it;
+
+	if (data->filter_reject_destroy != NULL) {
+		data->filter_reject_destroy(data->filter_reject_data);
+	}
+	data->filter_max_uncalled = max_uncalled;
+	data->filter_min_quality = min_quality;
+	data->filter_max_errors = max_errors;
+	data->filter_reject = reject;
+	data->filter_reject_data = reject_data;
+	data->filter_reject_destroy = reject_destroy;
+	data->filter = max_uncalled != SIZE_MAX || min_quality > 0 || max_errors < DBL_MAX;
+	for (it = 0; it < 256; it++) {
+		data->filter_error_probability[it] = pow(10, -(double) it / 10.0);
+	}
+}
+
+size_t panda_sam_reader_ordinal(
+	void *user_data) {
+	return ((struct reader_data *) user_data)->ordinal;
+}
+
+bool panda_sam_reader_set_umi(
+	void *user_data,
+	const char *tag,
+	size_t max_families) {
+	struct reader_data *data = user_data;
+	if (tag != NULL && strlen(tag) != 2) {
+		return false;
+	}
+	data->umi_enabled = true;
+	if (tag == NULL) {
+		data->umi_tag[0] = '\0';
+	} else {
+		memcpy(data->umi_tag, tag, 3);
+	}
+	data->umi_max_families = max_families < 1 ? 1 : max_families;
+	return true;
+}
+
+bool panda_sam_reader_set_shard(
+	void *user_data,
+	size_t index,
+	size_t count) {
+	struct reader_data *data = user_data;
+	if (count < 1 || index >= count) {
+		return false;
+	}
+	data->shard_index = index;
+	data->shard_count = count;
+	return true;
+}
+
+bool panda_sam_reader_set_threads(
+	void *user_data,
+	int threads) {
+	return hts_set_threads(((struct reader_data *) user_data)->file, threads) == 0;
+}
+
+bool ps_set_thread_pool(
+	void *user_data,
+	hts_tpool *pool) {
+	struct reader_data *data = user_data;
+	htsThreadPool shared = { pool, 0 };
+	if (data->thread_pool != NULL || hts_set_thread_pool(data->file, &shared) != 0) {
+		return false;
+	}
+	data->thread_pool = pool;
+	return true;
+}
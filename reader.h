@@ -0,0 +1,31 @@
+/* PANDAseq -- Assemble paired SAM/BAM Illumina reads and strip the region between amplification primers.
+     Copyright (C) 2012  Andre Masella
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef _PANDASEQ_SAM_READER_H
+#        define _PANDASEQ_SAM_READER_H
+#        include <stdbool.h>
+#        include <htslib/thread_pool.h>
+
+/*
+ * Decompress using a thread pool shared with other work. The reader takes
+ * ownership of the pool and destroys it after closing the file.
+ */
+bool ps_set_thread_pool(
+	void *user_data,
+	hts_tpool *pool);
+#endif
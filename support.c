@@ -17,19 +17,118 @@
  */
 
 #include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "pandaseq-sam.h"
 #ifdef HAVE_PTHREAD
 #        include <pthread.h>
 #        include "pandaseq-sam-mux.h"
 #endif
+#include <htslib/bgzf.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+struct bgzf_writer {
+	BGZF *file;
+	bool pooled;
+	char filename[];
+};
+
+/*
+ * Every compressed file shares one pool of threads. It is created by the
+ * first file that asks for threads and destroyed when the last one closes.
+ */
+static hts_tpool *bgzf_pool = NULL;
+static size_t bgzf_pool_users = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t bgzf_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 const char *panda_sam_version(
 	void) {
 	return hts_version();
 }
 
+static bool bgzf_pool_join(
+	BGZF *file,
+	int threads) {
+	bool result;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&bgzf_pool_mutex);
+#endif
+	if (bgzf_pool == NULL) {
+		bgzf_pool = hts_tpool_init(threads);
+	}
+	result = bgzf_pool != NULL && bgzf_thread_pool(file, bgzf_pool, 0) == 0;
+	if (result) {
+		bgzf_pool_users++;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&bgzf_pool_mutex);
+#endif
+	return result;
+}
+
+static void bgzf_pool_leave(
+	void) {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&bgzf_pool_mutex);
+#endif
+	if (--bgzf_pool_users == 0) {
+		hts_tpool_destroy(bgzf_pool);
+		bgzf_pool = NULL;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&bgzf_pool_mutex);
+#endif
+}
+
+static bool bgzf_writer_write(
+	const char *buffer,
+	size_t buffer_length,
+	struct bgzf_writer *writer) {
+	return bgzf_write(writer->file, buffer, buffer_length) == (ssize_t) buffer_length;
+}
+
+static void bgzf_writer_close(
+	struct bgzf_writer *writer) {
+	/* This is the final flush, so a full disk shows up here and the file is left without its end marker. bgzf_close does not reliably set errno. */
+	if (bgzf_close(writer->file) != 0) {
+		fprintf(stderr, "%s: could not finish writing; the compressed file is incomplete.\n", writer->filename);
+	}
+	if (writer->pooled) {
+		bgzf_pool_leave();
+	}
+	free(writer);
+}
+
+PandaWriter panda_sam_writer_open_bgzf(
+	const char *filename,
+	int threads) {
+	struct bgzf_writer *writer = malloc(sizeof(struct bgzf_writer) + strlen(filename) + 1);
+	if (writer == NULL) {
+		return NULL;
+	}
+	strcpy(writer->filename, filename);
+	writer->pooled = false;
+	writer->file = bgzf_open(filename, "w");
+	if (writer->file == NULL) {
+		free(writer);
+		return NULL;
+	}
+	if (threads > 1) {
+		writer->pooled = bgzf_pool_join(writer->file, threads);
+		if (!writer->pooled) {
+			bgzf_close(writer->file);
+			free(writer);
+			return NULL;
+		}
+	}
+	return panda_writer_new((PandaBufferWrite) bgzf_writer_write, writer, (PandaDestroy) bgzf_writer_close);
+}
+
 PandaAssembler panda_assembler_open_sam(
 	const char *filename,
 	PandaLogProxy logger,
@@ -0,0 +1,174 @@
+/* PANDAseq -- Assemble paired SAM/BAM Illumina reads and strip the region between amplification primers.
+     Copyright (C) 2012  Andre Masella
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+#define _POSIX_C_SOURCE 199309L
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pandaseq-sam.h"
+#include "trace.h"
+#ifdef HAVE_PTHREAD
+#        include <pthread.h>
+#endif
+
+/*
+ * Each thread records into its own ring, so recording never takes a lock. If
+ * a ring fills, the oldest events are overwritten.
+ */
+#define TRACE_CAPACITY (1 << 15)
+
+struct trace_event {
+	uint64_t begin;
+	uint32_t duration;
+	uint8_t stage;
+};
+
+struct trace_buffer {
+	struct trace_buffer *next;
+	size_t id;
+	size_t count;
+	struct trace_event events[TRACE_CAPACITY];
+};
+
+static const char *const stage_names[] = { "read", "parse", "pair", "fill", "assemble", "write", "reader lock", "writer lock", "writer wait" };
+
+bool trace_enabled = false;
+static FILE *trace_file = NULL;
+static struct trace_buffer *trace_buffers = NULL;
+static size_t trace_buffers_length = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+#else
+static struct trace_buffer *trace_single = NULL;
+#endif
+
+uint64_t trace_now(
+	void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static struct trace_buffer *trace_buffer_get(
+	void) {
+	struct trace_buffer *buffer;
+#ifdef HAVE_PTHREAD
+	buffer = pthread_getspecific(trace_key);
+#else
+	buffer = trace_single;
+#endif
+	if (buffer != NULL) {
+		return buffer;
+	}
+	buffer = malloc(sizeof(struct trace_buffer));
+	if (buffer == NULL) {
+		return NULL;
+	}
+	buffer->count = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&trace_mutex);
+#endif
+	buffer->id = trace_buffers_length++;
+	buffer->next = trace_buffers;
+	trace_buffers = buffer;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&trace_mutex);
+	pthread_setspecific(trace_key, buffer);
+#else
+	trace_single = buffer;
+#endif
+	return buffer;
+}
+
+void trace_record(
+	trace_stage stage,
+	uint64_t begin) {
+	struct trace_buffer *buffer = trace_buffer_get();
+	struct trace_event *event;
+	uint64_t duration = trace_now() - begin;
+	if (buffer == NULL) {
+		return;
+	}
+	event = &buffer->events[buffer->count++ % TRACE_CAPACITY];
+	event->begin = begin;
+	event->duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t) duration;
+	event->stage = stage;
+}
+
+bool panda_sam_trace_open(
+	const char *filename) {
+	if (trace_file != NULL) {
+		return false;
+	}
+	trace_file = fopen(filename, "w");
+	if (trace_file == NULL) {
+		perror(filename);
+		return false;
+	}
+#ifdef HAVE_PTHREAD
+	if (pthread_key_create(&trace_key, NULL) != 0) {
+		fclose(trace_file);
+		trace_file = NULL;
+		return false;
+	}
+#endif
+	trace_enabled = true;
+	return true;
+}
+
+bool panda_sam_trace_close(
+	void) {
+	struct trace_buffer *buffer;
+	bool first = true;
+	bool ok;
+	pid_t pid = getpid();
+
+	if (trace_file == NULL) {
+		return false;
+	}
+	trace_enabled = false;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&trace_mutex);
+#endif
+	fprintf(trace_file, "{\"traceEvents\":[");
+	while ((buffer = trace_buffers) != NULL) {
+		size_t it = buffer->count > TRACE_CAPACITY ? buffer->count - TRACE_CAPACITY : 0;
+		for (; it < buffer->count; it++) {
+			struct trace_event *event = &buffer->events[it % TRACE_CAPACITY];
+			fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"pandaseq-sam\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%zu}", first ? "" : ",", stage_names[event->stage], event->begin / 1000.0, event->duration / 1000.0, (long) pid, buffer->id);
+			first = false;
+		}
+		trace_buffers = buffer->next;
+		free(buffer);
+	}
+	fprintf(trace_file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	trace_buffers_length = 0;
+#ifdef HAVE_PTHREAD
+	pthread_key_delete(trace_key);
+	pthread_mutex_unlock(&trace_mutex);
+#else
+	trace_single = NULL;
+#endif
+	ok = !ferror(trace_file);
+	ok &= fclose(trace_file) == 0;
+	trace_file = NULL;
+	return ok;
+}
@@ -0,0 +1,60 @@
+/* PANDAseq -- Assemble paired SAM/BAM Illumina reads and strip the region between amplification primers.
+     Copyright (C) 2012  Andre Masella
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef _PANDASEQ_SAM_TRACE_H
+#        define _PANDASEQ_SAM_TRACE_H
+#        include <stdbool.h>
+#        include <stdint.h>
+
+/*
+ * The spans recorded:
+ * read: sam_read1, which decompresses and decodes one record
+ * parse: finding the UMI and parsing the read name into an identifier
+ * pair: matching a read with its mate
+ * fill: converting a pair into PANDAseq's bases and quality scores
+ * assemble, write: assembling a pair and writing the result
+ * reader lock, writer lock: waiting for another thread to finish reading or writing
+ * writer wait: waiting for earlier results to be written when output is ordered
+ */
+typedef enum {
+	TRACE_READ,
+	TRACE_PARSE,
+	TRACE_PAIR,
+	TRACE_FILL,
+	TRACE_ASSEMBLE,
+	TRACE_WRITE,
+	TRACE_READER_LOCK,
+	TRACE_WRITER_LOCK,
+	TRACE_WRITER_WAIT
+} trace_stage;
+
+extern bool trace_enabled;
+
+uint64_t trace_now(
+	void);
+
+void trace_record(
+	trace_stage stage,
+	uint64_t begin);
+
+/*
+ * Time a stage. When tracing is off, this is only a test of a global flag.
+ */
+#        define TRACE_BEGIN(name) uint64_t name = trace_enabled ? trace_now() : 0
+#        define TRACE_END(stage, name) do { if (trace_enabled) trace_record(stage, name); } while(0)
+#endif